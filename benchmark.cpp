@@ -0,0 +1,436 @@
+// End-to-end benchmark for spatial_color_quant. Quantizes a generated
+// corpus of gradients, noise and photo-like images with a fixed seed,
+// records wall time, peak memory, thread scaling and final energy for
+// each case, and compares them against a stored baseline. Exits with 1
+// if any case regressed by more than its tolerance or has no baseline
+// to compare against. The corpus and the outputs go
+// in a scratch directory, by default spatial_color_quant_bench under
+// $TMPDIR or /tmp.
+//
+// Usage: benchmark [--full] [--record] [--repeat <runs>]
+//                  [--baseline <file>] [--corpus <dir>] [--program <path>]
+//                  [--options "<spatial_color_quant options>"]
+//
+// --options passes the same options to every run, so a variant like
+// --softmax table can be checked against the usual baseline.
+//
+// Timings only mean something against a baseline recorded on the same
+// machine, so rerun with --record after moving to a new one.
+
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+enum content_kind { CONTENT_GRADIENT, CONTENT_NOISE, CONTENT_PHOTO };
+const char* content_names[] = {"gradient", "noise", "photo"};
+
+struct bench_case
+{
+    content_kind content;
+    int size, colors, filter_size;
+    // Also run on every hardware thread, to measure scaling
+    bool scaling;
+    // Only part of the full corpus, which takes hours and many GB
+    bool full;
+};
+
+// Each dimension is varied around photo-256-k16-f3 in the quick corpus;
+// the full one adds the larger sizes
+const bench_case cases[] = {
+    {CONTENT_GRADIENT, 256,   16, 3, false, false},
+    {CONTENT_NOISE,    256,   16, 3, false, false},
+    {CONTENT_PHOTO,    256,   16, 3, false, false},
+    {CONTENT_PHOTO,    256,    2, 3, false, false},
+    {CONTENT_PHOTO,    256,   64, 3, false, false},
+    {CONTENT_PHOTO,    256,   16, 1, false, false},
+    {CONTENT_PHOTO,    256,   16, 5, false, false},
+    {CONTENT_PHOTO,    512,   16, 3, true,  false},
+    {CONTENT_GRADIENT, 1024,  64, 5, false, true},
+    {CONTENT_NOISE,    1024, 256, 3, false, true},
+    {CONTENT_PHOTO,    1024,  16, 3, true,  true},
+    {CONTENT_PHOTO,    2048, 256, 3, false, true},
+    {CONTENT_PHOTO,    4096,  16, 3, true,  true},
+    {CONTENT_PHOTO,    8192,   2, 1, false, true},
+    {CONTENT_PHOTO,    8192,  16, 3, true,  true},
+};
+
+// How much worse than the baseline a case may get before it fails
+const double WALL_TOLERANCE = 0.25;	// fraction slower
+const double RSS_TOLERANCE = 0.10;	// fraction more memory
+const double ENERGY_TOLERANCE = 0.01;	// fraction higher energy
+const double SCALING_TOLERANCE = 0.10;	// drop in parallel efficiency
+
+const unsigned int BENCH_SEED = 1;
+
+// Set once in main, from --options
+vector<string> program_options;
+
+struct bench_result
+{
+    double wall_ms;
+    long peak_rss_kb;
+    double energy;
+    // Single thread time over threads times the threaded time, or 0 if
+    // not measured
+    double scaling;
+};
+
+string case_name(const bench_case& c)
+{
+    ostringstream name;
+    name << content_names[c.content] << "-" << c.size << "-k" << c.colors
+	 << "-f" << c.filter_size;
+    return name.str();
+}
+
+// A smooth color field with a few soft blobs, some hard-edged shapes
+// and a little grain, which is roughly what quantizing a photo is up
+// against
+struct photo_shape
+{
+    double x, y, radius;
+    double color[3];
+    bool hard, square;
+};
+
+// Write a size x size RGB image of the given content, one row at a
+// time so the largest ones fit
+bool generate_image(const char* filename, content_kind content, int size)
+{
+    FILE* out = fopen(filename, "wb");
+    if (out == NULL) {
+	printf("Could not open corpus file '%s'.\n", filename);
+	return false;
+    }
+    mt19937 rng(BENCH_SEED + size*3 + content);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    vector<photo_shape> shapes;
+    if (content == CONTENT_PHOTO) {
+	for (int n=0; n<24; n++) {
+	    photo_shape shape;
+	    shape.x = uniform(rng)*size;
+	    shape.y = uniform(rng)*size;
+	    shape.radius = (0.03 + 0.2*uniform(rng))*size;
+	    for (int k=0; k<3; k++) shape.color[k] = uniform(rng);
+	    shape.hard = n % 3 == 0;
+	    shape.square = n % 6 == 0;
+	    shapes.push_back(shape);
+	}
+    }
+    normal_distribution<double> grain(0.0, 0.02);
+    vector<unsigned char> row(3*size);
+    for (int y=0; y<size; y++) {
+	for (int x=0; x<size; x++) {
+	    double fx = (double)x/(size - 1), fy = (double)y/(size - 1);
+	    double color[3] = {0.0, 0.0, 0.0};
+	    switch (content) {
+	    case CONTENT_GRADIENT:
+		color[0] = fx;
+		color[1] = fy;
+		color[2] = 0.5*(1.0 - fx + fy);
+		break;
+	    case CONTENT_NOISE:
+		for (int k=0; k<3; k++) color[k] = uniform(rng);
+		break;
+	    case CONTENT_PHOTO:
+		color[0] = 0.3 + 0.4*fy;
+		color[1] = 0.4 + 0.2*sin(3.0*fx);
+		color[2] = 0.6 - 0.3*fy*fx;
+		for (unsigned int n=0; n<shapes.size(); n++) {
+		    const photo_shape& shape = shapes[n];
+		    double dx = x - shape.x, dy = y - shape.y;
+		    double weight;
+		    if (shape.hard) {
+			bool inside = shape.square ?
+			    max(fabs(dx), fabs(dy)) < shape.radius :
+			    dx*dx + dy*dy < shape.radius*shape.radius;
+			weight = inside ? 0.9 : 0.0;
+		    } else {
+			weight = exp(-(dx*dx + dy*dy)/(2*shape.radius*shape.radius));
+		    }
+		    for (int k=0; k<3; k++) {
+			color[k] += weight*(shape.color[k] - color[k]);
+		    }
+		}
+		for (int k=0; k<3; k++) color[k] += grain(rng);
+		break;
+	    }
+	    for (int k=0; k<3; k++) {
+		row[3*x + k] = (unsigned char)(255*min(1.0, max(0.0, color[k])) + 0.5);
+	    }
+	}
+	if (fwrite(&row[0], row.size(), 1, out) != 1) {
+	    printf("Could not write corpus file '%s'.\n", filename);
+	    fclose(out);
+	    return false;
+	}
+    }
+    fclose(out);
+    return true;
+}
+
+// Quantize one corpus image in a child process, timing it and taking
+// its peak RSS and the energy it reports
+bool run_quantizer(const string& program, const string& input,
+		   const string& output, const bench_case& c, int threads,
+		   bench_result& result)
+{
+    // Pass the default dithering level, since the filter size comes
+    // after it
+    ostringstream dithering;
+    dithering.precision(17);
+    dithering << 0.09*log((double)c.size*c.size) - 0.04*log((double)c.colors) + 0.001;
+    vector<string> args;
+    args.push_back(program);
+    args.insert(args.end(), program_options.begin(), program_options.end());
+    args.push_back("--seed");
+    args.push_back(to_string(BENCH_SEED));
+    args.push_back("--energy");
+    args.push_back("--threads");
+    args.push_back(to_string(threads));
+    args.push_back(input);
+    args.push_back(to_string(c.size));
+    args.push_back(to_string(c.size));
+    args.push_back(to_string(c.colors));
+    args.push_back(output);
+    args.push_back(dithering.str());
+    args.push_back(to_string(c.filter_size));
+    vector<char*> exec_argv;
+    for (unsigned int i=0; i<args.size(); i++) {
+	exec_argv.push_back(&args[i][0]);
+    }
+    exec_argv.push_back(NULL);
+    string log = output + ".log";
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+	printf("Could not start '%s'.\n", program.c_str());
+	return false;
+    }
+    if (pid == 0) {
+	int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) _exit(127);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+	execv(program.c_str(), &exec_argv[0]);
+	_exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+	printf("Lost track of '%s'.\n", program.c_str());
+	return false;
+    }
+    result.wall_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    result.peak_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	printf("'%s' failed on %s; see %s.\n", program.c_str(), input.c_str(), log.c_str());
+	return false;
+    }
+
+    ifstream in(log.c_str());
+    string line;
+    while (getline(in, line)) {
+	if (line.compare(0, 8, "Energy: ") == 0) {
+	    result.energy = atof(line.c_str() + 8);
+	    return true;
+	}
+    }
+    printf("'%s' reported no energy; see %s.\n", program.c_str(), log.c_str());
+    return false;
+}
+
+// Best of runs for the time, worst for the memory. The seed is fixed,
+// so the energy comes out the same every time.
+bool measure(const string& program, const string& input, const string& output,
+	     const bench_case& c, int threads, int runs, bench_result& result)
+{
+    for (int run=0; run<runs; run++) {
+	bench_result current;
+	if (!run_quantizer(program, input, output, c, threads, current)) {
+	    return false;
+	}
+	if (run == 0) {
+	    result = current;
+	} else {
+	    result.wall_ms = min(result.wall_ms, current.wall_ms);
+	    result.peak_rss_kb = max(result.peak_rss_kb, current.peak_rss_kb);
+	}
+    }
+    return true;
+}
+
+// Lines of "<case> <wall ms> <peak RSS KB> <energy> <scaling>"; lines
+// starting with # are comments
+void read_baseline(const char* filename, map<string, bench_result>& baseline)
+{
+    ifstream in(filename);
+    string line;
+    while (getline(in, line)) {
+	istringstream fields(line);
+	string name;
+	bench_result result;
+	if (!(fields >> name) || name[0] == '#') continue;
+	if (fields >> result.wall_ms >> result.peak_rss_kb >> result.energy >> result.scaling) {
+	    baseline[name] = result;
+	}
+    }
+}
+
+bool write_baseline(const char* filename, map<string, bench_result>& baseline)
+{
+    ofstream out(filename);
+    if (!out) {
+	printf("Could not write baseline '%s'.\n", filename);
+	return false;
+    }
+    out << "# Wall times are only comparable on the machine that recorded them" << endl;
+    out << "# case wall_ms peak_rss_kb energy scaling_efficiency" << endl;
+    out.precision(10);
+    for (map<string, bench_result>::iterator it = baseline.begin(); it != baseline.end(); ++it) {
+	out << it->first << " " << it->second.wall_ms << " " << it->second.peak_rss_kb
+	    << " " << it->second.energy << " " << it->second.scaling << endl;
+    }
+    return true;
+}
+
+// Name every metric that got worse than base allows, or return an empty
+// string
+string regressions(const bench_result& result, const bench_result& base)
+{
+    string failed;
+    if (result.wall_ms > base.wall_ms*(1 + WALL_TOLERANCE)) failed += " time";
+    if (result.peak_rss_kb > base.peak_rss_kb*(1 + RSS_TOLERANCE)) failed += " memory";
+    if (result.energy > base.energy*(1 + ENERGY_TOLERANCE)) failed += " energy";
+    if (result.scaling > 0 && base.scaling > 0 &&
+	result.scaling < base.scaling - SCALING_TOLERANCE) failed += " scaling";
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    bool full = false, record = false;
+    int runs = 3;
+    const char* baseline_file = "benchmark_baseline.txt";
+    const char* scratch = getenv("TMPDIR");
+    string corpus = string(scratch != NULL ? scratch : "/tmp") + "/spatial_color_quant_bench";
+    string program = "./spatial_color_quant";
+    for (int i=1; i<argc; i++) {
+	if (strcmp(argv[i], "--full") == 0) {
+	    full = true;
+	} else if (strcmp(argv[i], "--record") == 0) {
+	    record = true;
+	} else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+	    runs = atoi(argv[++i]);
+	    if (runs <= 0) {
+		printf("Number of runs must be at least 1.\n");
+		return 1;
+	    }
+	} else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+	    baseline_file = argv[++i];
+	} else if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+	    corpus = argv[++i];
+	} else if (strcmp(argv[i], "--program") == 0 && i + 1 < argc) {
+	    program = argv[++i];
+	} else if (strcmp(argv[i], "--options") == 0 && i + 1 < argc) {
+	    istringstream options(argv[++i]);
+	    string option;
+	    while (options >> option) {
+		program_options.push_back(option);
+	    }
+	} else {
+	    printf("Usage: benchmark [--full] [--record] [--repeat <runs>] [--baseline <file>] [--corpus <dir>] [--program <path>] [--options \"<spatial_color_quant options>\"]\n");
+	    return 1;
+	}
+    }
+    if (mkdir(corpus.c_str(), 0755) != 0 && errno != EEXIST) {
+	printf("Could not create corpus directory '%s'.\n", corpus.c_str());
+	return 1;
+    }
+
+    map<string, bench_result> baseline;
+    read_baseline(baseline_file, baseline);
+    int threads = max(1, (int)thread::hardware_concurrency());
+    if (threads == 1) {
+	printf("This machine has one CPU, so thread scaling is not measured.\n");
+    }
+
+    printf("%-22s %10s %10s %14s %8s  %s\n", "case", "wall ms", "peak MB", "energy", "scaling", "vs baseline");
+    int failures = 0;
+    for (unsigned int n=0; n<sizeof(cases)/sizeof(cases[0]); n++) {
+	const bench_case& c = cases[n];
+	if (c.full && !full) continue;
+	string name = case_name(c);
+	ostringstream input;
+	input << corpus << "/" << content_names[c.content] << "-" << c.size << ".rgb";
+	struct stat info;
+	if (stat(input.str().c_str(), &info) != 0 ||
+	    info.st_size != 3*(off_t)c.size*c.size) {
+	    if (!generate_image(input.str().c_str(), c.content, c.size)) return 1;
+	}
+	string output = corpus + "/" + name + ".out.rgb";
+
+	bench_result result;
+	if (!measure(program, input.str(), output, c, 1, runs, result)) {
+	    failures++;
+	    continue;
+	}
+	result.scaling = 0;
+	if (c.scaling && threads > 1) {
+	    bench_result threaded;
+	    if (!measure(program, input.str(), output, c, threads, runs, threaded)) {
+		failures++;
+		continue;
+	    }
+	    result.scaling = result.wall_ms/(threads*threaded.wall_ms);
+	}
+
+	string status;
+	if (record) {
+	    status = "recorded";
+	    baseline[name] = result;
+	} else if (baseline.count(name) == 0) {
+	    // Nothing to hold it to, which mustn't pass for a clean run
+	    status = "NO BASELINE: record one with --record";
+	    failures++;
+	} else {
+	    string failed = regressions(result, baseline[name]);
+	    if (failed.empty()) {
+		status = "ok";
+	    } else {
+		status = "REGRESSED:" + failed;
+		failures++;
+	    }
+	}
+	printf("%-22s %10.1f %10.1f %14.6f %8.3f  %s\n", name.c_str(), result.wall_ms,
+	       result.peak_rss_kb/1024.0, result.energy, result.scaling, status.c_str());
+	fflush(stdout);
+    }
+
+    if (record && !write_baseline(baseline_file, baseline)) return 1;
+    if (failures > 0) {
+	printf("%d case(s) failed.\n", failures);
+	return 1;
+    }
+    return 0;
+}
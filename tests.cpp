@@ -0,0 +1,366 @@
+// Regression tests for spatial_color_quant. The program is compiled in
+// with its main renamed, so each test can drive the annealer directly
+// on a generated image. Prints one line per test and exits with 1 if
+// any failed.
+//
+// Usage: tests
+
+#define main spatial_color_quant_main
+#include "spatial_color_quant.cpp"
+#undef main
+
+typedef array2d< vector_fixed<double, 3> > rgb_image;
+
+// Smooth shading with a few hard-edged disks over it, so there is both
+// dithering and edges to get right
+void make_test_image(rgb_image& image)
+{
+    int width = image.get_width(), height = image.get_height();
+    for (int y=0; y<height; y++) {
+	for (int x=0; x<width; x++) {
+	    double u = (double)x/width, v = (double)y/height;
+	    vector_fixed<double, 3>& pixel = image(x,y);
+	    pixel(0) = 0.5 + 0.4*sin(5*u + 2*v);
+	    pixel(1) = 0.5 + 0.4*cos(3*u*v + 4*v);
+	    pixel(2) = 0.5 + 0.4*sin(7*u - 3*v);
+	    for (int disk=0; disk<3; disk++) {
+		double du = u - 0.25*(disk + 1), dv = v - 0.3*(disk + 0.5);
+		if (du*du + dv*dv < 0.01) {
+		    pixel(disk) = 0.05;
+		}
+	    }
+	}
+    }
+}
+
+struct quantize_result
+{
+    double wall_ms, energy;
+};
+
+// Quantize with the same defaults as the program itself, from a palette
+// seeded the same way every time
+bool quantize(rgb_image& image, int num_colors, int filter_size,
+	      double time_budget_ms, int repeats_per_temp, int cycles,
+	      quantize_result& result)
+{
+    int width = image.get_width(), height = image.get_height();
+    srand(1);
+    vector< vector_fixed<double, 3> > palette;
+    for (int i=0; i<num_colors; i++) {
+	vector_fixed<double, 3> v;
+	for (int k=0; k<3; k++) {
+	    v(k) = ((double)rand())/RAND_MAX;
+	}
+	palette.push_back(v);
+    }
+    rgb_image filter_weights(filter_size, filter_size);
+    compute_filter_weights(filter_weights,
+			   0.09*log((double)width*height) - 0.04*log((double)num_colors) + 0.001);
+    array2d<int> quantized_image(width, height);
+    array3d<double>* coarse_variables = NULL;
+
+    double start_ms = current_time_ms();
+    if (!spatial_color_quant(image, filter_weights, quantized_image, palette,
+			     coarse_variables, 1.0, 0.001, 3, repeats_per_temp,
+			     time_budget_ms, 1, memory_plan(), VISIT_HILBERT, cycles)) {
+	return false;
+    }
+    result.wall_ms = current_time_ms() - start_ms;
+    result.energy = filtered_error_energy(image, quantized_image, palette, filter_weights);
+    delete coarse_variables;
+    return true;
+}
+
+// A budget is a promise about wall time: the run has to stop close to
+// it whatever the palette size, and one it would have met anyway must
+// not cost any quality.
+bool test_time_budget()
+{
+    // Above the fixed cost of building the pyramids and finishing, and
+    // well below what the runs take unbudgeted. The tolerance leaves
+    // room for a loaded machine, where every step takes longer than the
+    // plan measured for the ones before it.
+    const double budgets[] = {500, 1500};
+    const double TOLERANCE = 0.10, TOLERANCE_MS = 50;
+    struct { int size, colors; } cases[] = {{256, 64}, {128, 256}};
+    bool passed = true;
+    for (unsigned int c=0; c<sizeof(cases)/sizeof(cases[0]); c++) {
+	rgb_image image(cases[c].size, cases[c].size);
+	make_test_image(image);
+	for (unsigned int n=0; n<sizeof(budgets)/sizeof(budgets[0]); n++) {
+	    quantize_result result;
+	    if (!quantize(image, cases[c].colors, 3, budgets[n], 1, 0, result)) {
+		return false;
+	    }
+	    if (result.wall_ms > budgets[n]*(1 + TOLERANCE) + TOLERANCE_MS) {
+		printf("\n%dx%d with %d colors took %.0f ms on a %.0f ms budget\n",
+		       cases[c].size, cases[c].size, cases[c].colors,
+		       result.wall_ms, budgets[n]);
+		passed = false;
+	    }
+	}
+    }
+
+    rgb_image image(128, 128);
+    make_test_image(image);
+    quantize_result unbudgeted, budgeted;
+    if (!quantize(image, 16, 3, 0.0, 1, 0, unbudgeted) ||
+	!quantize(image, 16, 3, 3*unbudgeted.wall_ms + 500, 1, 0, budgeted)) {
+	return false;
+    }
+    if (fabs(budgeted.energy - unbudgeted.energy) > 1e-3*unbudgeted.energy) {
+	printf("\nA generous budget changed the energy from %f to %f\n",
+	       unbudgeted.energy, budgeted.energy);
+	passed = false;
+    }
+    return passed;
+}
+
+// A coarse grid correction sweeps the coarser levels, which track
+// effort over their own tiles. The current level's tiles have to come
+// through it intact, or its repeats stop or go on according to the
+// coarse level's.
+bool test_correction_keeps_effort_tiles()
+{
+    rgb_image image(128, 128);
+    make_test_image(image);
+    srand(1);
+    vector< vector_fixed<double, 3> > palette;
+    for (int i=0; i<8; i++) {
+	vector_fixed<double, 3> v;
+	for (int k=0; k<3; k++) {
+	    v(k) = ((double)rand())/RAND_MAX;
+	}
+	palette.push_back(v);
+    }
+    rgb_image filter_weights(3, 3);
+    compute_filter_weights(filter_weights, 0.8);
+    image_annealer<3> annealer(image, palette.size());
+    vector<image_annealer<3>*> annealers(1, &annealer);
+    annealer.build_pyramids(filter_weights);
+    annealer.start(palette, 1);
+
+    // Down to level 1, still warm enough for corrections
+    const double temperature = 2*CYCLE_MIN_TEMPERATURE;
+    for (int level=annealer.get_max_coarse_level(); level>=1; level--) {
+	annealer.zoom_to(level, palette);
+	annealer.sweep(palette, temperature, 0.0);
+	update_shared_palette(annealers, palette, 1);
+	annealer.end_step();
+    }
+    bool passed = true;
+    for (int repeat=0; repeat<3; repeat++) {
+	annealer.sweep(palette, temperature, 0.0);
+	int active_tiles = annealer.active_tiles();
+	bool settled = annealer.settled();
+	annealer.coarse_correction(palette, temperature, 1, 0.0);
+	if (annealer.active_tiles() != active_tiles || annealer.settled() != settled) {
+	    printf("\nA correction changed the active tiles from %d to %d\n",
+		   active_tiles, annealer.active_tiles());
+	    passed = false;
+	}
+	update_shared_palette(annealers, palette, 1);
+    }
+
+    // And a whole cycled run with repeats comes out as good as one
+    // without, give or take how the random choices fall
+    quantize_result once, repeated;
+    if (!quantize(image, 16, 3, 0.0, 1, 1, once) ||
+	!quantize(image, 16, 3, 0.0, 3, 1, repeated)) {
+	return false;
+    }
+    if (repeated.energy > once.energy*1.05) {
+	printf("\nThree repeats with corrections gave energy %f, against %f with one\n",
+	       repeated.energy, once.energy);
+	passed = false;
+    }
+    return passed;
+}
+
+// Each level's b window has pixel I at its center, so it has to be
+// symmetric about it and largest there, and for a 1x1 filter non-zero
+// there, whatever the filter size
+bool test_centered_b_pyramid()
+{
+    rgb_image image(64, 64);
+    make_test_image(image);
+    bool passed = true;
+    for (int filter_size=1; filter_size<=5; filter_size+=2) {
+	rgb_image filter_weights(filter_size, filter_size);
+	compute_filter_weights(filter_weights, 0.8);
+	image_annealer<3> annealer(image, 4);
+	annealer.build_pyramids(filter_weights);
+	for (int level=0; level<=annealer.get_max_coarse_level(); level++) {
+	    rgb_image& b = annealer.get_b(level);
+	    int width = b.get_width(), height = b.get_height();
+	    vector_fixed<double, 3> center = b((width - 1)/2, (height - 1)/2);
+	    bool centered = true;
+	    for (int y=0; y<height; y++) {
+		for (int x=0; x<width; x++) {
+		    for (int k=0; k<3; k++) {
+			double value = b(x, y)(k), mirrored = b(width - 1 - x, height - 1 - y)(k);
+			if (!(fabs(value - mirrored) <= 1e-12*center(k)) || value > center(k)) {
+			    centered = false;
+			}
+		    }
+		}
+	    }
+	    for (int k=0; k<3; k++) {
+		if (!(center(k) > 0)) centered = false;
+	    }
+	    if (!centered) {
+		printf("\nThe b window of a %dx%d filter is off center at level %d\n",
+		       filter_size, filter_size, level);
+		passed = false;
+	    }
+	}
+    }
+    return passed;
+}
+
+// An opaque RGBA image has to come back opaque, every alpha byte 255,
+// with its colors rounded rather than truncated from the palette
+bool test_opaque_rgba_round_trip()
+{
+    const int size = 64, num_colors = 8;
+    rgb_image rgb(size, size);
+    make_test_image(rgb);
+    array2d< vector_fixed<double, 4> > image(size, size);
+    for (int y=0; y<size; y++) {
+	for (int x=0; x<size; x++) {
+	    for (int k=0; k<3; k++) {
+		image(x,y)(k) = rgb(x,y)(k);
+	    }
+	    image(x,y)(3) = 1.0;
+	}
+    }
+    srand(1);
+    vector< vector_fixed<double, 4> > palette;
+    for (int i=0; i<num_colors; i++) {
+	vector_fixed<double, 4> v;
+	for (int k=0; k<4; k++) {
+	    v(k) = ((double)rand())/RAND_MAX;
+	}
+	palette.push_back(v);
+    }
+    array2d< vector_fixed<double, 4> > filter_weights(3, 3);
+    compute_filter_weights(filter_weights, 0.8);
+    array2d<int> quantized_image(size, size);
+    array3d<double>* coarse_variables = NULL;
+    if (!spatial_color_quant(image, filter_weights, quantized_image, palette,
+			     coarse_variables, 1.0, 0.001, 3, 1)) {
+	return false;
+    }
+    delete coarse_variables;
+
+    const char* dir = getenv("TMPDIR");
+    string path = string(dir != NULL ? dir : "/tmp") + "/spatial_color_quant_test.rgba";
+    if (!write_raw_image(path.c_str(), quantized_image, palette)) {
+	return false;
+    }
+    vector<unsigned char> bytes(size*size*4);
+    FILE* in = fopen(path.c_str(), "rb");
+    bool complete = in != NULL && fread(&bytes[0], bytes.size(), 1, in) == 1;
+    if (in != NULL) fclose(in);
+    remove(path.c_str());
+    if (!complete) {
+	printf("\nCould not read back %s\n", path.c_str());
+	return false;
+    }
+    int translucent = 0, off_color = 0;
+    for (int y=0; y<size; y++) {
+	for (int x=0; x<size; x++) {
+	    unsigned char* c = &bytes[(y*size + x)*4];
+	    if (c[3] != 255) translucent++;
+	    vector_fixed<double, 4>& color = palette[quantized_image(x,y)];
+	    for (int k=0; k<3; k++) {
+		double expected = 255*min(1.0, max(0.0, color(k)/color(3)));
+		if (fabs(c[k] - expected) > 0.5 + 1e-9) off_color++;
+	    }
+	}
+    }
+    if (translucent > 0 || off_color > 0) {
+	printf("\n%d of %d pixels came back translucent and %d channels off color\n",
+	       translucent, size*size, off_color);
+	return false;
+    }
+    return true;
+}
+
+// Zooming up to an odd size leaves a last row and column with no coarse
+// pixel of their own. When the run stops above the finest level they
+// are never swept, so they have to take their neighbours' weights, not
+// come out as flat stripes of whichever color has index 0.
+bool test_odd_edges_follow_neighbours()
+{
+    const int size = 301;
+    rgb_image image(size, size);
+    make_test_image(image);
+    srand(1);
+    vector< vector_fixed<double, 3> > palette;
+    for (int i=0; i<8; i++) {
+	vector_fixed<double, 3> v;
+	for (int k=0; k<3; k++) {
+	    v(k) = ((double)rand())/RAND_MAX;
+	}
+	palette.push_back(v);
+    }
+    rgb_image filter_weights(3, 3);
+    compute_filter_weights(filter_weights, 0.8);
+    bool passed = true;
+    // Finishing from level 2 zooms whole levels; keeping only level 2
+    // zooms the rest a row at a time
+    for (int finest_level=0; finest_level<=2; finest_level+=2) {
+	image_annealer<3> annealer(image, palette.size());
+	vector<image_annealer<3>*> annealers(1, &annealer);
+	annealer.build_pyramids(filter_weights);
+	annealer.start(palette, 1);
+	for (int level=annealer.get_max_coarse_level(); level>=2; level--) {
+	    annealer.zoom_to(level, palette);
+	    annealer.sweep(palette, 0.1, 0.0);
+	    update_shared_palette(annealers, palette, 1);
+	    annealer.end_step();
+	}
+	array2d<int> quantized_image(size, size);
+	annealer.finish(quantized_image, palette, finest_level);
+	int off_row = 0, off_column = 0;
+	for (int i=0; i<size; i++) {
+	    if (quantized_image(i, size-1) != quantized_image(i, size-2)) off_row++;
+	    if (quantized_image(size-1, i) != quantized_image(size-2, i)) off_column++;
+	}
+	if (off_row > 0 || off_column > 0) {
+	    printf("\nFinishing from level %d, %d pixels of the last row and %d of the"
+		   " last column differ from their neighbours\n",
+		   finest_level, off_row, off_column);
+	    passed = false;
+	}
+    }
+    return passed;
+}
+
+struct test_case
+{
+    const char* name;
+    bool (*run)();
+};
+
+const test_case tests[] = {
+    {"time budget", test_time_budget},
+    {"correction keeps effort tiles", test_correction_keeps_effort_tiles},
+    {"centered b pyramid", test_centered_b_pyramid},
+    {"opaque rgba round trip", test_opaque_rgba_round_trip},
+    {"odd edges follow neighbours", test_odd_edges_follow_neighbours},
+};
+
+int main()
+{
+    int failures = 0;
+    for (unsigned int n=0; n<sizeof(tests)/sizeof(tests[0]); n++) {
+	bool passed = tests[n].run();
+	printf("\n%-30s %s\n", tests[n].name, passed ? "ok" : "FAILED");
+	fflush(stdout);
+	if (!passed) failures++;
+    }
+    return failures > 0 ? 1 : 0;
+}